@@ -1,4 +1,11 @@
 #include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <unordered_map>
 #include <opencv2/opencv.hpp>
 #include <dirent.h>
 #include <boost/property_tree/ptree.hpp>
@@ -18,7 +25,8 @@ struct Parameters {
     string mosaic_image_path;
     int tile_size;
     int num_small;
-    Parameters() : target_image_path(""), reference_image_folder(""), mosaic_image_path(""), tile_size(5), num_small(10000) {}
+    int self_check;
+    Parameters() : target_image_path(""), reference_image_folder(""), mosaic_image_path(""), tile_size(5), num_small(10000), self_check(0) {}
 };
 
 Parameters readParameters(const string& filepath) {
@@ -33,28 +41,43 @@ Parameters readParameters(const string& filepath) {
     parameters.mosaic_image_path = pt.get<string>("path.mosaic_image");
     parameters.tile_size = pt.get<int>("parameter.tile_size");
     parameters.num_small = pt.get<int>("parameter.num_small");
+    parameters.self_check = pt.get<int>("parameter.self_check", 0);
     return parameters;
 }
 
 struct DataWithImg {
     vector<type> data;
     Mat img;
-    DataWithImg(const vector<type>& data, const Mat& img) : data(data), img(img) {}
+    int id;
+    DataWithImg(const vector<type>& data, const Mat& img, int id = -1) : data(data), img(img), id(id) {}
 };
 
 class KdNode {
 private:
     DataWithImg  data_img;
     KdNode* left, * right;   
+    // Bounding box of every point in this subtree
+    vector<type> low, high;
+    // First snapshot epoch in which the tile counts as removed
+    atomic<unsigned long> dead_epoch;
 public:
     //KdNode(const vector<int>& data, const Mat& img) : data_img(DataWithImg(data, img)), left(nullptr), right(nullptr) {}
-    KdNode(const DataWithImg& data_img) : data_img(data_img), left(nullptr), right(nullptr) {}
+    KdNode(const DataWithImg& data_img, const vector<type>& low, const vector<type>& high) :
+        data_img(data_img), left(nullptr), right(nullptr), low(low), high(high),
+        dead_epoch(numeric_limits<unsigned long>::max()) {}
     ~KdNode() {
         if (left) delete left;
         if (right) delete right;
     }
+    const DataWithImg& getDataImg() const { return data_img; }
     const vector<type>& getData() const { return data_img.data; }
     const Mat& getImg() const { return data_img.img; }
+    int getId() const { return data_img.id; }
+    const vector<type>& getLow() const { return low; }
+    const vector<type>& getHigh() const { return high; }
+    // The snapshot publish orders these accesses, so relaxed loads and stores are enough
+    bool isDead(unsigned long epoch) const { return dead_epoch.load(memory_order_relaxed) <= epoch; }
+    void markDead(unsigned long epoch) { dead_epoch.store(epoch, memory_order_relaxed); }
     KdNode*& buildLeft() { return left; }
     KdNode*& buildRight() { return right; }
     KdNode*  getLeft() { return left; }
@@ -65,13 +88,17 @@ class KdTree {
 private:
     KdNode* root;
     void build(vector<DataWithImg> data_img, KdNode*& node, int depth, int dim);
-    double CalDistance(const vector<type>& a, const vector<type>& b, int dim);
-    KdNode* findClosest(DataWithImg& data_img, KdNode* node, int depth, int dim);
+    static double BoxDistance(const vector<type>& point, KdNode* node, int dim);
+    void findClosest(DataWithImg& data_img, KdNode* node, int depth, int dim,
+                     unsigned long epoch, KdNode*& best, double& best_distance);
+    void collect(KdNode* node, vector<KdNode*>& out);
     void release(KdNode* node);
 public:
     KdTree() : root(nullptr) {}
+    static double CalDistance(const vector<type>& a, const vector<type>& b, int dim);
     void build(vector<DataWithImg>data_img, int dim);
-    KdNode* findClosest(DataWithImg& data, int dim);
+    KdNode* findClosest(DataWithImg& data, int dim, unsigned long epoch, double& best_distance);
+    void collect(vector<KdNode*>& out);
     void release();
 };
 void KdTree::build(vector<DataWithImg> data_img, KdNode*& node, int depth, int dim) {
@@ -83,10 +110,16 @@ void KdTree::build(vector<DataWithImg> data_img, KdNode*& node, int depth, int d
     nth_element(data_img.begin(), data_img.begin() + data_img.size() / 2 , data_img.end(),compare);
     int medianIndex = data_img.size() / 2;
     vector<type> median = data_img[medianIndex].data;
-    Mat medianImg = data_img[medianIndex].img;
+    // Record the bounding box of the subtree so that searches can skip it without descending
+    vector<type> low = data_img[0].data, high = data_img[0].data;
+    for (size_t i = 1; i < data_img.size(); i++) {
+        for (int j = 0; j < dim; j++) {
+            low[j] = min(low[j], data_img[i].data[j]);
+            high[j] = max(high[j], data_img[i].data[j]);
+        }
+    }
     // Create new node and recursively construct subtrees
-    DataWithImg median_str(median, medianImg);
-    node = new KdNode(median_str);
+    node = new KdNode(data_img[medianIndex], low, high);
     vector<DataWithImg> leftData, rightData;
     for (int i = 0; i < data_img.size(); i++) {
         if (i != medianIndex) {
@@ -113,54 +146,56 @@ double KdTree::CalDistance(const vector<type>& a, const vector<type>& b ,int dim
     return sqrt(distance);
 }
 
-KdNode* KdTree::findClosest(DataWithImg& data_img, KdNode* node, int depth,int dim) {
-    if (!node) {
-        return nullptr;
-    }
-    int axis = depth % dim;
-    KdNode* next = nullptr, * opposite = nullptr;
-    if (data_img.data[axis] < node->getData()[axis]) {
-        next = node->getLeft();
-        opposite = node->getRight();
-    }
-    else {
-        next = node->getRight();
-        opposite = node->getLeft();
+// Distance from a point to the bounding box of a subtree, 0 when the point is inside
+double KdTree::BoxDistance(const vector<type>& point, KdNode* node, int dim) {
+    double distance = 0;
+    for (int i = 0; i < dim; i++) {
+        double gap = 0;
+        if (point[i] < node->getLow()[i]) gap = node->getLow()[i] - point[i];
+        else if (point[i] > node->getHigh()[i]) gap = point[i] - node->getHigh()[i];
+        distance += gap * gap;
     }
+    return sqrt(distance);
+}
 
-    KdNode* best = findClosest(data_img, next, depth + 1, dim);
-    if (!best) {
-        best = node;
+// Exact search that skips tiles removed by epoch and only reports nodes closer than best_distance.
+// A subtree whose bounding box is out of reach is skipped entirely, so a tight initial bound
+// cuts the descent as well as the backtracking.
+void KdTree::findClosest(DataWithImg& data_img, KdNode* node, int depth, int dim,
+                         unsigned long epoch, KdNode*& best, double& best_distance) {
+    if (!node || BoxDistance(data_img.data, node, dim) >= best_distance) {
+        return;
     }
-    else {
-        double best_distance = CalDistance(best->getData(), data_img.data, dim);
+    int axis = depth % dim;
+    double diff = data_img.data[axis] - node->getData()[axis];
+    KdNode* next = diff < 0 ? node->getLeft() : node->getRight();
+    KdNode* opposite = diff < 0 ? node->getRight() : node->getLeft();
+    if (!node->isDead(epoch)) {
         double node_distance = CalDistance(node->getData(), data_img.data, dim);
         if (node_distance < best_distance) {
             best = node;
+            best_distance = node_distance;
         }
     }
-    double best_distance = CalDistance(best->getData(), data_img.data, dim);
-    if (CalDistance(data_img.data,node->getData(), dim) > best_distance) {
-        return best;
-    }
-    else {
-        KdNode* other_best = findClosest(data_img, opposite, depth + 1, dim);
-        if (!other_best) {
-            return best;
-        }
-        else {
-            double other_best_distance = CalDistance(other_best->getData(), data_img.data, dim);
-            if (other_best_distance < best_distance) {
-                return other_best;
-            }
-            else {
-                return best;
-            }
-        }
+    findClosest(data_img, next, depth + 1, dim, epoch, best, best_distance);
+    findClosest(data_img, opposite, depth + 1, dim, epoch, best, best_distance);
+}
+KdNode* KdTree::findClosest(DataWithImg& data_img, int dim, unsigned long epoch, double& best_distance) {
+    KdNode* best = nullptr;
+    findClosest(data_img, root, 0, dim, epoch, best, best_distance);
+    return best;
+}
+
+void KdTree::collect(KdNode* node, vector<KdNode*>& out) {
+    if (!node) {
+        return;
     }
+    out.push_back(node);
+    collect(node->getLeft(), out);
+    collect(node->getRight(), out);
 }
-KdNode* KdTree::findClosest(DataWithImg& data_img,int dim) {
-    return findClosest(data_img, root, 0,dim);
+void KdTree::collect(vector<KdNode*>& out) {
+    collect(root, out);
 }
 
 void KdTree::release(KdNode* node) {
@@ -176,12 +211,303 @@ void KdTree::release() {
     root = nullptr;
 }
 
+// Dynamic tile index built as a logarithmic forest of static kd-trees.
+// Level i holds at most 2^i tiles. An insert merges the occupied low levels into
+// the first empty one, so every tile is rebuilt O(log n) times over its lifetime.
+// A remove only stamps the tile's node with the epoch of the next snapshot, which
+// is O(1); once half of a level is dead that level alone is rebuilt from the survivors.
+// Writers publish a new immutable snapshot after every update. Readers keep the
+// snapshot they loaded and ignore stamps newer than its epoch, and a retired tree
+// is released when its last reader drops it.
+class KdForest {
+public:
+    struct Level {
+        shared_ptr<KdTree> tree;
+        size_t size;
+        size_t dead;
+        Level() : tree(nullptr), size(0), dead(0) {}
+    };
+    struct Snapshot {
+        vector<Level> levels;
+        int dim;
+        unsigned long epoch;
+        KdNode* findClosest(DataWithImg& data_img, double& best_distance) const;
+        KdNode* findClosest(DataWithImg& data_img) const;
+        // Returns the closest node for every query, in input order; createPhotomosaic passes
+        // its cells row-major with grid_cols cells per row. The nodes live in this snapshot's
+        // trees, so the caller must hold the snapshot's shared_ptr while it uses them.
+        vector<KdNode*> findClosestBatch(vector<DataWithImg>& queries) const;
+    };
+private:
+    shared_ptr<const Snapshot> current;
+    mutex writer;
+    struct Location {
+        size_t level;
+        KdNode* node;
+    };
+    vector<Level> levels;
+    unordered_map<int, Location> location_of;
+    int dim;
+    unsigned long epoch;
+    Level makeLevel(vector<DataWithImg>& data_img, size_t index);
+    void collectLive(const Level& level, vector<DataWithImg>& out);
+    void markDead(int id);
+    void publish();
+public:
+    KdForest(int dim) : dim(dim), epoch(0) { publish(); }
+    void build(vector<DataWithImg> data_img);
+    void insert(const DataWithImg& data_img);
+    bool remove(int id);
+    shared_ptr<const Snapshot> snapshot() const { return atomic_load(&current); }
+};
+
+KdNode* KdForest::Snapshot::findClosest(DataWithImg& data_img, double& best_distance) const {
+    KdNode* best = nullptr;
+    // The bound carries over between levels, so later trees are pruned by earlier hits
+    for (const Level& level : levels) {
+        if (!level.tree) continue;
+        KdNode* candidate = level.tree->findClosest(data_img, dim, epoch, best_distance);
+        if (candidate) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+KdNode* KdForest::Snapshot::findClosest(DataWithImg& data_img) const {
+    double best_distance = numeric_limits<double>::infinity();
+    return findClosest(data_img, best_distance);
+}
+
+// Interleaves the bits of the color channels so that similar colors get nearby codes
+static unsigned int mortonCode(const vector<type>& data, int dim) {
+    unsigned int code = 0;
+    for (int bit = 7; bit >= 0; bit--) {
+        for (int i = 0; i < dim && i < 3; i++) {
+            int channel = min(max(data[i], 0), 255);
+            code = (code << 1) | ((channel >> bit) & 1);
+        }
+    }
+    return code;
+}
+
+// Queries are visited in Morton order over color space. Each search starts with the previous
+// answer as its candidate, and a query equal to the previous one reuses its answer outright.
+vector<KdNode*> KdForest::Snapshot::findClosestBatch(vector<DataWithImg>& queries) const {
+    int n = queries.size();
+    vector<KdNode*> closest(n, nullptr);
+    vector<unsigned int> codes(n);
+    for (int i = 0; i < n; i++) {
+        codes[i] = mortonCode(queries[i].data, dim);
+    }
+    vector<int> order(n);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&codes](int a, int b) { return codes[a] < codes[b]; });
+    // Each thread walks a contiguous run of the sorted order and carries its own seed
+    const int chunk_size = 256;
+    int num_chunks = (n + chunk_size - 1) / chunk_size;
+    #pragma omp parallel for
+    for (int c = 0; c < num_chunks; c++) {
+        KdNode* previous = nullptr;
+        const vector<type>* previous_query = nullptr;
+        int end = min(n, (c + 1) * chunk_size);
+        for (int k = c * chunk_size; k < end; k++) {
+            DataWithImg& query = queries[order[k]];
+            // Flat image regions give runs of identical cells
+            if (previous_query && *previous_query == query.data) {
+                closest[order[k]] = previous;
+                continue;
+            }
+            // The previous answer is still a live tile, so its distance is a valid upper bound
+            double best_distance = numeric_limits<double>::infinity();
+            if (previous) {
+                best_distance = KdTree::CalDistance(previous->getData(), query.data, dim);
+            }
+            KdNode* best = findClosest(query, best_distance);
+            if (!best) {
+                best = previous;
+            }
+            closest[order[k]] = best;
+            previous = best;
+            previous_query = &query.data;
+        }
+    }
+    return closest;
+}
+
+KdForest::Level KdForest::makeLevel(vector<DataWithImg>& data_img, size_t index) {
+    Level level;
+    if (data_img.empty()) return level;
+    level.tree = shared_ptr<KdTree>(new KdTree(), [](KdTree* tree) {
+        tree->release();
+        delete tree;
+    });
+    level.tree->build(data_img, dim);
+    level.size = data_img.size();
+    vector<KdNode*> nodes;
+    level.tree->collect(nodes);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        location_of[nodes[i]->getId()] = { index, nodes[i] };
+    }
+    return level;
+}
+
+void KdForest::collectLive(const Level& level, vector<DataWithImg>& out) {
+    if (!level.tree) return;
+    vector<KdNode*> nodes;
+    level.tree->collect(nodes);
+    // Stamps made since the last publish carry epoch + 1
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (!nodes[i]->isDead(epoch + 1)) {
+            out.push_back(nodes[i]->getDataImg());
+        }
+    }
+}
+
+void KdForest::markDead(int id) {
+    Location location = location_of[id];
+    location_of.erase(id);
+    Level& level = levels[location.level];
+    // Published snapshots have a smaller epoch and keep seeing the tile as alive
+    location.node->markDead(epoch + 1);
+    level.dead++;
+    if (level.dead * 2 > level.size) {
+        vector<DataWithImg> live;
+        collectLive(level, live);
+        level = makeLevel(live, location.level);
+    }
+}
+
+void KdForest::publish() {
+    epoch++;
+    shared_ptr<const Snapshot> next(new Snapshot{ levels, dim, epoch });
+    atomic_store(&current, next);
+}
+
+// Bulk load: replaces the whole index with a single level
+void KdForest::build(vector<DataWithImg> data_img) {
+    lock_guard<mutex> lock(writer);
+    levels.clear();
+    location_of.clear();
+    size_t index = 0;
+    while ((size_t(1) << index) < data_img.size()) index++;
+    levels.resize(index + 1);
+    levels[index] = makeLevel(data_img, index);
+    publish();
+}
+
+// Inserting an id that is already present replaces the old tile
+void KdForest::insert(const DataWithImg& data_img) {
+    lock_guard<mutex> lock(writer);
+    if (location_of.count(data_img.id)) {
+        markDead(data_img.id);
+    }
+    vector<DataWithImg> carry(1, data_img);
+    size_t index = 0;
+    while (index < levels.size() && levels[index].tree) {
+        collectLive(levels[index], carry);
+        levels[index] = Level();
+        index++;
+    }
+    if (index == levels.size()) levels.push_back(Level());
+    levels[index] = makeLevel(carry, index);
+    publish();
+}
+
+bool KdForest::remove(int id) {
+    lock_guard<mutex> lock(writer);
+    if (!location_of.count(id)) return false;
+    markDead(id);
+    publish();
+    return true;
+}
+
+// Randomized check of KdForest: mixes inserts, replacements, removes and queries, and compares
+// every answer with a brute-force scan. Meanwhile a reader thread keeps querying the snapshot
+// taken before the first update, which must keep returning its original answers.
+bool checkForest(int num_tiles, int num_steps, int dim) {
+    mt19937 rng(12345);
+    auto randomColor = [&rng, dim]() {
+        vector<type> color;
+        for (int i = 0; i < dim; i++) color.push_back(rng() % 256);
+        return color;
+    };
+    KdForest forest(dim);
+    vector<int> ids;
+    unordered_map<int, vector<type>> colors;
+    vector<DataWithImg> data_imgs;
+    for (int i = 0; i < num_tiles; i++) {
+        data_imgs.emplace_back(DataWithImg(randomColor(), Mat(), i));
+        ids.push_back(i);
+        colors[i] = data_imgs.back().data;
+    }
+    forest.build(data_imgs);
+
+    shared_ptr<const KdForest::Snapshot> held = forest.snapshot();
+    vector<DataWithImg> held_queries;
+    vector<int> held_ids;
+    for (int i = 0; i < 64; i++) {
+        held_queries.emplace_back(DataWithImg(randomColor(), Mat()));
+        held_ids.push_back(held->findClosest(held_queries.back())->getId());
+    }
+    atomic<bool> done(false), held_ok(true);
+    thread reader([&]() {
+        while (!done) {
+            for (size_t i = 0; i < held_queries.size(); i++) {
+                if (held->findClosest(held_queries[i])->getId() != held_ids[i]) held_ok = false;
+            }
+        }
+    });
+
+    bool ok = !forest.remove(-1);
+    int next_id = num_tiles;
+    for (int step = 0; step < num_steps && ok; step++) {
+        int op = rng() % 4;
+        if (op == 0 || ids.empty()) {
+            DataWithImg data_img(randomColor(), Mat(), next_id++);
+            forest.insert(data_img);
+            ids.push_back(data_img.id);
+            colors[data_img.id] = data_img.data;
+        }
+        else if (op == 1) {
+            // Inserting an existing id replaces its color
+            DataWithImg data_img(randomColor(), Mat(), ids[rng() % ids.size()]);
+            forest.insert(data_img);
+            colors[data_img.id] = data_img.data;
+        }
+        else if (op == 2) {
+            int index = rng() % ids.size();
+            int id = ids[index];
+            ids[index] = ids.back();
+            ids.pop_back();
+            colors.erase(id);
+            ok = forest.remove(id);
+        }
+        else {
+            DataWithImg query(randomColor(), Mat());
+            shared_ptr<const KdForest::Snapshot> snapshot = forest.snapshot();
+            KdNode* closest = snapshot->findClosest(query);
+            double best_distance = numeric_limits<double>::infinity();
+            for (size_t i = 0; i < ids.size(); i++) {
+                best_distance = min(best_distance, KdTree::CalDistance(colors[ids[i]], query.data, dim));
+            }
+            ok = closest && colors.count(closest->getId()) && closest->getData() == colors[closest->getId()] &&
+                 KdTree::CalDistance(closest->getData(), query.data, dim) == best_distance;
+        }
+    }
+    done = true;
+    reader.join();
+    return ok && held_ok;
+}
+
 // Function for creating a photomosaic image using the "divide and conquer" method
 
-Mat createPhotomosaic(Mat target_image, KdTree tree, int tile_size,int dim) {
+Mat createPhotomosaic(Mat target_image, const KdForest::Snapshot& index, int tile_size) {
     // Create a mosaic image with the same size as the target image
     Mat mosaic_image = Mat::zeros(target_image.rows, target_image.cols, CV_8UC3);
     // Divide the target image into a grid of tiles
+    int grid_rows = (target_image.rows + tile_size - 1) / tile_size;
+    int grid_cols = (target_image.cols + tile_size - 1) / tile_size;
+    vector<DataWithImg> cells(grid_rows * grid_cols, DataWithImg(vector<type>(), Mat()));
     #pragma omp parallel for
     for (int y = 0; y < target_image.rows; y += tile_size) {
         for (int x = 0; x < target_image.cols; x += tile_size) {
@@ -192,9 +518,15 @@ Mat createPhotomosaic(Mat target_image, KdTree tree, int tile_size,int dim) {
             rgb.push_back(tile_mean[0]);
             rgb.push_back(tile_mean[1]);
             rgb.push_back(tile_mean[2]);
-            // Find the closest matching tile image in the tree
-            DataWithImg data_img(rgb, tile);
-            KdNode* closest_node = tree.findClosest(data_img, dim); 
+            cells[(y / tile_size) * grid_cols + x / tile_size] = DataWithImg(rgb, tile);
+        }
+    }
+    // Find the closest matching tile image for every cell in one batch
+    vector<KdNode*> closest_nodes = index.findClosestBatch(cells);
+    #pragma omp parallel for
+    for (int y = 0; y < target_image.rows; y += tile_size) {
+        for (int x = 0; x < target_image.cols; x += tile_size) {
+            KdNode* closest_node = closest_nodes[(y / tile_size) * grid_cols + x / tile_size];
             Mat closest_image = closest_node->getImg();
             // Replace the tile in the mosaic image with the closest matching tile image
             resize(closest_image, closest_image, cv::Size(tile_size, tile_size));
@@ -257,11 +589,14 @@ int main() {
     int dim = 3;
 
     Parameters parameters = readParameters("../config.ini");
+    if (parameters.self_check) {
+        cout << "self check: " << (checkForest(1000, 5000, dim) ? "passed" : "FAILED") << endl;
+    }
     // Load image
     Mat target_image = imread(parameters.target_image_path);
     // Create vector to store individual RGB values
     vector<DataWithImg> data_imgs;
-    KdTree tree;
+    KdForest forest(dim);
     for (int i = 1; i <= parameters.num_small; i++) {
         Mat reference_image = imread(parameters.reference_image_folder + '/' + to_string(i) + ".jpg");
         Scalar reference_mean = mean(reference_image);
@@ -269,16 +604,16 @@ int main() {
         rgb.push_back(reference_mean[0]);
         rgb.push_back(reference_mean[1]);
         rgb.push_back(reference_mean[2]);
-        data_imgs.emplace_back(DataWithImg(rgb, reference_image));
+        data_imgs.emplace_back(DataWithImg(rgb, reference_image, i));
     }   
-    tree.build(data_imgs, dim);  
-    Mat mosaic_image = createPhotomosaic(target_image, tree, parameters.tile_size,dim);
+    forest.build(data_imgs);
+    shared_ptr<const KdForest::Snapshot> snapshot = forest.snapshot();
+    Mat mosaic_image = createPhotomosaic(target_image, *snapshot, parameters.tile_size);
     double te = (double)getTickCount();
     double T = (te - ts) * 1000 / getTickFrequency();//λms
     cout << "time: " << T << endl;
     //imshow("win", mosaic_image);
     //waitKey(0);
     imwrite(parameters.mosaic_image_path, mosaic_image);
-    tree.release();
     return 0;
 }